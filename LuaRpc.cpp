@@ -6,6 +6,7 @@
 lua_CFunction reexport_luaopen_luacapnp = luaopen_luacapnp;
 
 #include "NetHost.h"
+#include "NetCapture.h"
 
 #if LUA_VERSION_NUM<502
 #define lua_rawlen lua_objlen
@@ -16,13 +17,58 @@ lua_CFunction reexport_luaopen_luacapnp = luaopen_luacapnp;
 namespace GAG
 {
 	static int id = 0;
-	//[-1, +1, m] name, addr -> connection
+
+	// percent-escape the characters NetTcp splits the options on, so paths may contain them
+	static void appendescaped(std::string& out, const char* s)
+	{
+		static const char hex[] = "0123456789ABCDEF";
+		for (; *s; s++)
+		{
+			if (*s == '%' || *s == '?' || *s == '&' || *s == '=')
+			{
+				out += '%';
+				out += hex[(unsigned char)*s >> 4];
+				out += hex[(unsigned char)*s & 0xF];
+			}
+			else
+			{
+				out += *s;
+			}
+		}
+	}
+
+	//[-2|3, +1, m] name, addr, options -> connection
+	// addr is "host:port", or "unix:/path" ("unix:@name" for an abstract socket) for a peer on the same host
+	// options is a table of connection settings, e.g. { pack = 256 }, carried to NetTcp as "addr?pack=256"
+	// class = "realtime" makes the network loop spin for that connection; leave it unset for bulk links
 	static int lopen(lua_State *L)
 	{
 		const char* name = luaL_checkstring(L, 1);
-		const char* addr = luaL_checkstring(L, 2);
+		std::string addr;
+		appendescaped(addr, luaL_checkstring(L, 2));
+		if (lua_istable(L, 3))
+		{
+			char sep = '?';
+			lua_pushnil(L);
+			while (lua_next(L, 3) != 0)
+			{
+				lua_pushvalue(L, -2); // tostring on a copy, keep the key intact for lua_next
+				const char* key = lua_tostring(L, -1);
+				const char* value = lua_isboolean(L, -2) ? (lua_toboolean(L, -2) ? "1" : "0") : lua_tostring(L, -2);
+				if (key && value)
+				{
+					addr += sep;
+					appendescaped(addr, key);
+					addr += '=';
+					appendescaped(addr, value);
+					sep = '&';
+				}
+				lua_pop(L, 2);
+			}
+		}
 		id++;
 		NetHost::Control()->queueReq.Enqueue(NetControl::Open{ id, kj::str(name), addr });
+		NetTcp::Wake();
 		lua_pushinteger(L, id);
 		return 1;
 	}
@@ -46,12 +92,34 @@ namespace GAG
 			memcpy(buffer.begin(), data, size);
 		}
 		NetHost::Control()->queueReq.Enqueue(NetControl::Send{ c, lside, lsession, lcode, kj::mv(buffer) });
+		NetTcp::Wake();
 		LogWarn("lua send", c, lside, lsession, lcode);  // TODO
 		return 0;
 	}
 
+	static int pushrecv(lua_State *L, NetControl::Recv& msg)
+	{
+		lua_pushboolean(L, msg.side);
+		lua_pushinteger(L, msg.session);
+		lua_pushinteger(L, msg.code);
+		if (msg.session == 0 && msg.code == 0xFFFF)
+		{
+			assert(msg.data.size() * sizeof(capnp::word) == 4 * sizeof(double));
+			double* data_arr = (double*)msg.data.begin();
+			lua_pushnumber(L, data_arr[0]);
+			lua_pushnumber(L, data_arr[1]);
+			lua_pushnumber(L, data_arr[2]);
+			lua_pushnumber(L, data_arr[3]);
+			LogDebug("recv ping", msg.id, msg.side, msg.session, msg.code, data_arr[0], data_arr[1]);
+			return 7;
+		}
+
+		lua_pushlstring(L, (const char*)msg.data.begin(), msg.data.size() * sizeof(msg.data[0]));
+		return 4;
+	}
+
 	static std::map<int, std::queue<NetControl::Recv> > recvQueues;
-	//[-1, +0|5, m] connection -> side, session, code, data, data2
+	//[-1, +0|4|7, m] connection -> side, session, code, data | side, session, code, offset, rtt, min_rtt, raw_offset
 	static int lrecv(lua_State *L)
 	{
 		int c = (int)lua_tointeger(L, 1);
@@ -62,27 +130,10 @@ namespace GAG
 			if (!q.empty())
 			{
 				auto& msg = q.front();
-				lua_pushboolean(L, msg.side);
-				lua_pushinteger(L, msg.session);
-				lua_pushinteger(L, msg.code);
-				if (msg.session == 0 && msg.code == 0xFFFF)
-				{
-					assert(msg.data.size() == 2 * sizeof(double));
-					double* data_arr = (double*)msg.data.begin();
-					lua_pushnumber(L, data_arr[0]);
-					lua_pushnumber(L, data_arr[1]);
-					LogDebug("recv ping pop", c, msg.id, msg.side, msg.session, msg.code, data_arr[0], data_arr[1]);
-					q.pop();
-					return 5;
-				}
-				else
-				{
-					lua_pushlstring(L, (const char*)msg.data.begin(), msg.data.size() * sizeof(msg.data[0]));
-				}
-
+				int ret = pushrecv(L, msg);
 				LogWarn("recv pop", c, msg.id, msg.side, msg.session, msg.code);  // TODO
 				q.pop();
-				return 4;
+				return ret;
 			}
 		}
 		for (;;)
@@ -95,24 +146,8 @@ namespace GAG
 					{
 						if (msg.id == c)
 						{
-							lua_pushboolean(L, msg.side);
-							lua_pushinteger(L, msg.session);
-							lua_pushinteger(L, msg.code);
-							if (msg.session == 0 && msg.code == 0xFFFF)
-							{
-								assert(msg.data.size() == 2 * sizeof(double));
-								double* data_arr = (double*)msg.data.begin();
-								lua_pushnumber(L, data_arr[0]);
-								lua_pushnumber(L, data_arr[1]);
-								LogDebug("recv ping good", c, msg.id, msg.side, msg.session, msg.code, data_arr[0], data_arr[1]);
-								return 5;
-							}
-							else
-							{
-								lua_pushlstring(L, (const char*)msg.data.begin(), msg.data.size() * sizeof(msg.data[0]));
-							}
 							LogWarn("recv good", c, msg.id, msg.side, msg.session, msg.code); // TODO
-							return 4;
+							return pushrecv(L, msg);
 						}
 						else
 						{
@@ -135,6 +170,44 @@ namespace GAG
 	{
 		int c = (int)lua_tointeger(L, 1);
 		NetHost::Control()->queueReq.Enqueue(NetControl::Close{ c });
+		NetTcp::Wake();
+		return 1;
+	}
+
+	//[-2|3|4, +1, m] path, addr, speed, timeout -> stats table | nil
+	// plays back the out frames of a capture against addr, speed 1 = recorded pace (default), N = N times faster, 0 = max;
+	// blocks the calling thread for at most timeout seconds (default 600)
+	static int lreplay(lua_State *L)
+	{
+		const char* path = luaL_checkstring(L, 1);
+		const char* addr = luaL_checkstring(L, 2);
+		double speed = luaL_optnumber(L, 3, 1.0);
+		double timeout = luaL_optnumber(L, 4, 600.0);
+
+		NetCapture::ReplayStats stats;
+		if (!NetCapture::Replay(path, addr, speed, timeout, stats))
+		{
+			lua_pushnil(L);
+			return 1;
+		}
+
+		lua_createtable(L, 0, 8);
+		lua_pushinteger(L, (lua_Integer)stats.frames);
+		lua_setfield(L, -2, "frames");
+		lua_pushinteger(L, (lua_Integer)stats.bytes);
+		lua_setfield(L, -2, "bytes");
+		lua_pushinteger(L, (lua_Integer)stats.responses);
+		lua_setfield(L, -2, "responses");
+		lua_pushnumber(L, stats.seconds);
+		lua_setfield(L, -2, "seconds");
+		lua_pushnumber(L, stats.avg_ms);
+		lua_setfield(L, -2, "avg_ms");
+		lua_pushnumber(L, stats.p50_ms);
+		lua_setfield(L, -2, "p50_ms");
+		lua_pushnumber(L, stats.p99_ms);
+		lua_setfield(L, -2, "p99_ms");
+		lua_pushnumber(L, stats.max_ms);
+		lua_setfield(L, -2, "max_ms");
 		return 1;
 	}
 
@@ -143,6 +216,7 @@ namespace GAG
 		{ "send", lsend },
 		{ "recv", lrecv },
 		{ "close", lclose },
+		{ "replay", lreplay },
 		{ NULL, NULL }
 	};
 
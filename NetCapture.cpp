@@ -0,0 +1,607 @@
+#include "../utils/PCH.h"
+
+#include "NetCapture.h"
+
+#ifdef __ANDROID__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define LOG_MOD							"NetCapture"
+#define CAPTURE_CHUNK_SIZE				4 * 1024 * 1024		// file grows and the view moves by this much
+#define REPLAY_DRAIN_TIMEOUT			5000 * 1000			// us to wait for the last responses
+
+#ifdef _MSC_VER
+#undef	errno
+#define errno							WSAGetLastError()
+#define CAPTURE_ALIGN					(64 * 1024)			// MapViewOfFile offset granularity
+#define REPLAY_CLOSE(s)					closesocket(s)
+#define REPLAY_EINTR					WSAEINTR
+#define REPLAY_WOULDBLOCK(err)			((err) == WSAEWOULDBLOCK)
+#define REPLAY_INPROGRESS(err)			((err) == WSAEWOULDBLOCK)
+#define REPLAY_SEND_FLAGS				0
+#endif
+
+#ifdef __ANDROID__
+#define CAPTURE_ALIGN					(uint64_t)sysconf(_SC_PAGESIZE)
+#define INVALID_SOCKET					(~0)
+#define REPLAY_CLOSE(s)					close(s)
+#define REPLAY_EINTR					EINTR
+#define REPLAY_WOULDBLOCK(err)			((err) == EAGAIN || (err) == EWOULDBLOCK)
+#define REPLAY_INPROGRESS(err)			((err) == EINPROGRESS)
+#define REPLAY_SEND_FLAGS				MSG_NOSIGNAL		// a closed peer is an error here, not a SIGPIPE
+#endif
+
+namespace GAG
+{
+	NetCapture::NetCapture(const std::string& _path) : path(_path)
+	{
+#ifdef _MSC_VER
+		file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			LogWarn("NetCapture open error", path.c_str(), (int)GetLastError());
+			return;
+		}
+#endif
+
+#ifdef __ANDROID__
+		fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+		{
+			LogWarn("NetCapture open error", path.c_str(), errno);
+			return;
+		}
+#endif
+		Reserve(0);
+	}
+
+	NetCapture::~NetCapture()
+	{
+		Unmap();
+#ifdef _MSC_VER
+		if (file != INVALID_HANDLE_VALUE)
+		{
+			// drop the unused tail of the last chunk
+			LARGE_INTEGER end;
+			end.QuadPart = (LONGLONG)pos;
+			SetFilePointerEx(file, end, nullptr, FILE_BEGIN);
+			SetEndOfFile(file);
+			CloseHandle(file);
+		}
+#endif
+
+#ifdef __ANDROID__
+		if (fd >= 0)
+		{
+			if (ftruncate(fd, (off_t)pos) < 0)
+				LogWarn("NetCapture truncate error", path.c_str(), errno);
+			close(fd);
+		}
+#endif
+	}
+
+	void NetCapture::Unmap()
+	{
+		if (view == nullptr)
+		{
+			return;
+		}
+
+#ifdef _MSC_VER
+		UnmapViewOfFile(view);
+		CloseHandle(mapping);
+		mapping = nullptr;
+#endif
+
+#ifdef __ANDROID__
+		munmap(view, view_size);
+#endif
+		view = nullptr;
+		view_size = 0;
+	}
+
+	// make [pos, pos + size) writable through view; only moves the view when the current one is full
+	bool NetCapture::Reserve(size_t size)
+	{
+		if (view && pos + size <= view_offset + view_size)
+		{
+			return true;
+		}
+
+		Unmap();
+		uint64_t offset = pos - pos % CAPTURE_ALIGN;
+		size_t length = (size_t)std::max<uint64_t>(CAPTURE_CHUNK_SIZE, pos - offset + size);
+		length += (size_t)(CAPTURE_ALIGN - length % CAPTURE_ALIGN) % CAPTURE_ALIGN;
+
+#ifdef _MSC_VER
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		uint64_t end = offset + length;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)(end >> 32), (DWORD)end, nullptr);
+		if (mapping == nullptr)
+		{
+			LogWarn("NetCapture mapping error", path.c_str(), (int)GetLastError());
+			return false;
+		}
+		view = (char*)MapViewOfFile(mapping, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)offset, length);
+		if (view == nullptr)
+		{
+			LogWarn("NetCapture map error", path.c_str(), (int)GetLastError());
+			CloseHandle(mapping);
+			mapping = nullptr;
+			return false;
+		}
+#endif
+
+#ifdef __ANDROID__
+		if (fd < 0)
+			return false;
+
+		if (ftruncate(fd, (off_t)(offset + length)) < 0)
+		{
+			LogWarn("NetCapture grow error", path.c_str(), errno);
+			return false;
+		}
+		void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)offset);
+		if (p == MAP_FAILED)
+		{
+			LogWarn("NetCapture map error", path.c_str(), errno);
+			return false;
+		}
+		view = (char*)p;
+#endif
+		view_offset = offset;
+		view_size = length;
+		return true;
+	}
+
+	// network thread; a memcpy into the page cache, the kernel writes it back on its own
+	void NetCapture::Write(Dir dir, int64_t timestamp, const char* frame, size_t size)
+	{
+		Record r;
+		r.timestamp = timestamp;
+		r.size = (uint32_t)size;
+		r.dir = dir;
+
+		if (!Reserve(sizeof(r) + size))
+		{
+			return;
+		}
+
+		char* p = view + (pos - view_offset);
+		memcpy(p, &r, sizeof(r));
+		memcpy(p + sizeof(r), frame, size);
+		pos += sizeof(r) + size;
+	}
+
+	// read-only counterpart of Reserve for Replay, maps the capture a chunk at a time instead of loading it
+	class CaptureReader
+	{
+	public:
+		explicit CaptureReader(const std::string& _path) : path(_path)
+		{
+#ifdef _MSC_VER
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			LARGE_INTEGER length;
+			if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &length))
+			{
+				LogWarn("Replay open error", path.c_str(), (int)GetLastError());
+				return;
+			}
+			size = (uint64_t)length.QuadPart;
+			// a zero length file cannot be mapped, and has no records anyway
+			if (size > 0)
+			{
+				mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (mapping == nullptr)
+				{
+					LogWarn("Replay mapping error", path.c_str(), (int)GetLastError());
+					return;
+				}
+			}
+#endif
+
+#ifdef __ANDROID__
+			fd = open(path.c_str(), O_RDONLY);
+			struct stat st;
+			if (fd < 0 || fstat(fd, &st) < 0)
+			{
+				LogWarn("Replay open error", path.c_str(), errno);
+				return;
+			}
+			size = (uint64_t)st.st_size;
+#endif
+			ok = true;
+		}
+
+		~CaptureReader()
+		{
+			Unmap();
+#ifdef _MSC_VER
+			if (mapping != nullptr)
+				CloseHandle(mapping);
+			if (file != INVALID_HANDLE_VALUE)
+				CloseHandle(file);
+#endif
+
+#ifdef __ANDROID__
+			if (fd >= 0)
+				close(fd);
+#endif
+		}
+
+		bool IsOpen() const { return ok; }
+		uint64_t Size() const { return size; }
+
+		// [offset, offset + length) of the file, nullptr past the end or when it cannot be mapped
+		const char* Get(uint64_t offset, size_t length)
+		{
+			if (offset + length > size)
+			{
+				return nullptr;
+			}
+			if (view && offset >= view_offset && offset + length <= view_offset + view_size)
+			{
+				return view + (offset - view_offset);
+			}
+
+			Unmap();
+			uint64_t start = offset - offset % CAPTURE_ALIGN;
+			size_t map = (size_t)std::min<uint64_t>(std::max<uint64_t>(CAPTURE_CHUNK_SIZE, offset - start + length), size - start);
+
+#ifdef _MSC_VER
+			view = (char*)MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(start >> 32), (DWORD)start, map);
+			if (view == nullptr)
+			{
+				LogWarn("Replay map error", path.c_str(), (int)GetLastError());
+				return nullptr;
+			}
+#endif
+
+#ifdef __ANDROID__
+			void* p = mmap(nullptr, map, PROT_READ, MAP_SHARED, fd, (off_t)start);
+			if (p == MAP_FAILED)
+			{
+				LogWarn("Replay map error", path.c_str(), errno);
+				return nullptr;
+			}
+			view = (char*)p;
+#endif
+			view_offset = start;
+			view_size = map;
+			return view + (offset - view_offset);
+		}
+
+	private:
+		void Unmap()
+		{
+			if (view == nullptr)
+			{
+				return;
+			}
+#ifdef _MSC_VER
+			UnmapViewOfFile(view);
+#endif
+
+#ifdef __ANDROID__
+			munmap(view, view_size);
+#endif
+			view = nullptr;
+			view_size = 0;
+		}
+
+		std::string path;
+#ifdef _MSC_VER
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#endif
+#ifdef __ANDROID__
+		int fd = -1;
+#endif
+		bool ok = false;
+		uint64_t size = 0;
+		char* view = nullptr;
+		uint64_t view_offset = 0;
+		size_t view_size = 0;
+	};
+
+	// non-blocking connect bounded by deadline, the socket stays non-blocking for the replay
+	static bool ReplayConnect(SOCKET s, const sockaddr_t& saddr, int64_t deadline)
+	{
+#ifdef _MSC_VER
+		u_long mode = 1;
+		if (ioctlsocket(s, FIONBIO, &mode) != 0)
+			return false;
+#endif
+
+#ifdef __ANDROID__
+		int mode = fcntl(s, F_GETFL, 0);
+		if (mode < 0 || fcntl(s, F_SETFL, mode | O_NONBLOCK) < 0)
+			return false;
+#endif
+
+		if (connect(s, (const struct sockaddr *)&saddr, sizeof(saddr)) == 0)
+		{
+			return true;
+		}
+		if (!REPLAY_INPROGRESS(errno))
+		{
+			return false;
+		}
+
+		for (;;)
+		{
+			int64_t wait = deadline - NetTcp::Now();
+			if (wait <= 0)
+			{
+				return false;
+			}
+			fd_set wset;
+			FD_ZERO(&wset);
+			FD_SET(s, &wset);
+			struct timeval tv = { (long)(wait / 1000000), (long)(wait % 1000000) };
+			int ret = select((int)s + 1, nullptr, &wset, nullptr, &tv);
+			if (ret < 0 && errno == REPLAY_EINTR)
+			{
+				continue;
+			}
+			if (ret <= 0)
+			{
+				return false;
+			}
+
+			int err = 0;
+			socklen_t len = sizeof(err);
+			return getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&err, &len) == 0 && err == 0;
+		}
+	}
+
+	bool NetCapture::Replay(const std::string& path, const std::string& addr, double speed, double timeout, ReplayStats& stats)
+	{
+		CaptureReader capture(path);
+		if (!capture.IsOpen())
+		{
+			return false;
+		}
+
+#ifdef _MSC_VER
+		// replay may run before any lopen started winsock; startup is counted, so pair it here
+		WSADATA wsad;
+		WSAStartup(WINSOCK_VERSION, &wsad);
+		struct WsaCleanup { ~WsaCleanup() { WSACleanup(); } } wsa_cleanup;
+#endif
+
+		size_t position = addr.find(':');
+		std::string Ip(addr, 0, position);
+		std::string Port(addr, position + 1, addr.size());
+
+		hostent *he;
+		if ((he = gethostbyname(Ip.c_str())) == 0)
+		{
+			LogWarn("Replay gethostbyname error", addr.c_str());
+			return false;
+		}
+
+		sockaddr_t saddr;
+		memset(&saddr, 0, sizeof(saddr));
+		saddr.sin_family = AF_INET;
+		saddr.sin_port = htons(atoi(Port.c_str()));
+		saddr.sin_addr = *((in_addr *)he->h_addr);
+
+		SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (s == INVALID_SOCKET)
+		{
+			LogWarn("Replay socket error", addr.c_str(), errno);
+			return false;
+		}
+
+		// non-blocking throughout, a peer that stops reading must not wedge the lua thread in send
+		int64_t start = NetTcp::Now();
+		int64_t deadline = start + (int64_t)(timeout * 1000000);
+		if (!ReplayConnect(s, saddr, deadline))
+		{
+			LogWarn("Replay connect error", addr.c_str(), errno);
+			REPLAY_CLOSE(s);
+			return false;
+		}
+
+		std::map<int, int64_t> inflight;	// request session -> sent at
+		std::vector<int64_t> latencies;
+		std::string recv_buffer;
+		char buf[64 * 1024];
+
+		const char* frame = nullptr;		// out frame being sent, stays mapped until the next Get
+		uint32_t frame_size = 0;
+		uint32_t sent = 0;
+		int64_t due = 0;
+		int64_t first = -1;
+		int64_t drain_until = 0;			// set once the last frame is out
+		uint64_t offset = 0;
+		bool done = false;
+		bool closed = false;
+		bool ok = true;
+		while (ok && !closed)
+		{
+			while (frame == nullptr && !done)
+			{
+				Record r;
+				const char* p = offset + sizeof(r) <= capture.Size() ? capture.Get(offset, sizeof(r)) : nullptr;
+				if (p == nullptr)
+				{
+					ok = offset + sizeof(r) > capture.Size();
+					done = true;
+					break;
+				}
+				memcpy(&r, p, sizeof(r));
+				p = capture.Get(offset + sizeof(r), r.size);
+				if (p == nullptr)
+				{
+					// past the end is a capture cut short by a crash, anything else failed to map
+					if (offset + sizeof(r) + r.size > capture.Size())
+						LogWarn("Replay truncated capture", path.c_str(), offset, capture.Size());
+					else
+						ok = false;
+					done = true;
+					break;
+				}
+				offset += sizeof(r) + r.size;
+				if (r.dir != Out)
+				{
+					continue;
+				}
+
+				if (first < 0)
+				{
+					first = r.timestamp;
+				}
+				frame = p;
+				frame_size = r.size;
+				sent = 0;
+				due = speed > 0 ? start + (int64_t)((r.timestamp - first) / speed) : 0;
+			}
+			if (!ok)
+			{
+				break;
+			}
+
+			int64_t now = NetTcp::Now();
+			if (frame == nullptr)
+			{
+				if (drain_until == 0)
+				{
+					drain_until = std::min<int64_t>(now + REPLAY_DRAIN_TIMEOUT, deadline);
+				}
+				if (inflight.empty() || now >= drain_until)
+				{
+					break;
+				}
+			}
+			if (now >= deadline)
+			{
+				LogWarn("Replay timeout", path.c_str(), stats.frames, inflight.size());
+				ok = false;
+				break;
+			}
+
+			// responses are read while sending, so a full receive window never stalls the peer
+			bool writing = frame != nullptr && now >= due;
+			int64_t wait = frame == nullptr ? drain_until - now : (writing ? deadline - now : std::min(due, deadline) - now);
+			fd_set rset, wset;
+			FD_ZERO(&rset);
+			FD_ZERO(&wset);
+			FD_SET(s, &rset);
+			if (writing)
+			{
+				FD_SET(s, &wset);
+			}
+			struct timeval tv = { (long)(wait / 1000000), (long)(wait % 1000000) };
+			int ret = select((int)s + 1, &rset, &wset, nullptr, &tv);
+			if (ret < 0)
+			{
+				int err = errno;
+				if (err != REPLAY_EINTR)
+				{
+					LogWarn("Replay select error", ret, err);
+					ok = false;
+				}
+				continue;
+			}
+
+			if (FD_ISSET(s, &rset))
+			{
+				for (;;)
+				{
+					int rv = recv(s, buf, sizeof(buf), 0);
+					if (rv < 0)
+					{
+						int err = errno;
+						if (!REPLAY_WOULDBLOCK(err))
+						{
+							LogWarn("Replay recv error", rv, err);
+							closed = true;
+						}
+						break;
+					}
+					if (rv == 0)
+					{
+						LogWarn("Replay recv closed", rv);
+						closed = true;
+						break;
+					}
+					recv_buffer.append(buf, rv);
+				}
+
+				size_t parsed = 0;
+				while (recv_buffer.size() - parsed >= sizeof(NetHeader))
+				{
+					const NetHeader* header = (const NetHeader*)(recv_buffer.c_str() + parsed);
+					size_t length = (ntohl(header->size) & SIZE_MASK) + sizeof(header->size);
+					if (recv_buffer.size() - parsed < length)
+					{
+						break;
+					}
+
+					auto it = (header->session & 0x8000) ? inflight.find(header->session & 0x7FFF) : inflight.end();
+					if (it != inflight.end())
+					{
+						latencies.push_back(NetTcp::Now() - it->second);
+						inflight.erase(it);
+					}
+					parsed += length;
+				}
+				recv_buffer.erase(0, parsed);
+			}
+
+			if (writing && FD_ISSET(s, &wset))
+			{
+				while (sent < frame_size)
+				{
+					int sendlen = send(s, frame + sent, (int)(frame_size - sent), REPLAY_SEND_FLAGS);
+					if (sendlen < 0)
+					{
+						int err = errno;
+						if (!REPLAY_WOULDBLOCK(err))
+						{
+							LogWarn("Replay send error", sendlen, err);
+							ok = false;
+						}
+						break;
+					}
+					sent += sendlen;
+				}
+
+				if (sent == frame_size)
+				{
+					const NetHeader* header = (const NetHeader*)frame;
+					if (frame_size >= sizeof(NetHeader) && !(header->session & 0x8000) && header->session != 0)
+					{
+						inflight[header->session] = NetTcp::Now();
+					}
+					stats.frames++;
+					stats.bytes += frame_size;
+					frame = nullptr;
+				}
+			}
+		}
+		REPLAY_CLOSE(s);
+
+		stats.seconds = (NetTcp::Now() - start) / 1000000.0;
+		stats.responses = (int64_t)latencies.size();
+		if (!latencies.empty())
+		{
+			std::sort(latencies.begin(), latencies.end());
+			int64_t sum = 0;
+			for (auto l : latencies)
+				sum += l;
+			stats.avg_ms = sum / 1000.0 / latencies.size();
+			stats.p50_ms = latencies[latencies.size() / 2] / 1000.0;
+			stats.p99_ms = latencies[latencies.size() * 99 / 100] / 1000.0;
+			stats.max_ms = latencies.back() / 1000.0;
+		}
+		LogWarn("Replay done", path.c_str(), stats.frames, stats.bytes, stats.responses, stats.seconds, stats.p50_ms, stats.p99_ms);
+		return ok && !closed;
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "NetTcp.h"
+
+namespace GAG
+{
+	// append-only capture of the framed messages of one connection, written through a memory map
+	// file layout: repeated [Record][frame bytes as on the wire, NetHeader + body]
+	class NetCapture
+	{
+	public:
+		enum Dir : uint8_t
+		{
+			In	= 0,
+			Out = 1,
+		};
+
+#pragma pack(push, 1)
+		struct Record
+		{
+			int64_t timestamp;	// NetTcp::Now(), us
+			uint32_t size;		// frame bytes that follow
+			uint8_t dir;
+		};
+#pragma pack(pop)
+
+		struct ReplayStats
+		{
+			int64_t frames = 0;		// out frames sent
+			int64_t bytes = 0;
+			int64_t responses = 0;	// responses matched to a sent request
+			double seconds = 0;
+			double avg_ms = 0;
+			double p50_ms = 0;
+			double p99_ms = 0;
+			double max_ms = 0;
+		};
+
+		explicit NetCapture(const std::string& path);
+		~NetCapture();
+
+		bool IsOpen() const { return view != nullptr; }
+		void Write(Dir dir, int64_t timestamp, const char* frame, size_t size);
+
+		// send the out frames of a capture to addr ("host:port"), speed 1 = recorded pace, N = N times faster, 0 = no waits;
+		// the whole run, connect and last responses included, gives up after timeout seconds
+		static bool Replay(const std::string& path, const std::string& addr, double speed, double timeout, ReplayStats& stats);
+
+	private:
+		bool Reserve(size_t size);
+		void Unmap();
+
+		std::string path;
+#ifdef _MSC_VER
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#endif
+#ifdef __ANDROID__
+		int fd = -1;
+#endif
+		char* view = nullptr;
+		uint64_t view_offset = 0;	// file offset of view
+		size_t view_size = 0;
+		uint64_t pos = 0;			// file offset of the next record
+	};
+}
@@ -3,7 +3,6 @@
 #include "NetTcp.h"
 #include "NetFilter.h"
 #include "../utils/kjlua.h"
-#include <chrono>
 
 
 #define LOG_MOD "NetHost"
@@ -14,17 +13,26 @@ namespace GAG
 
 	NetHost* NetHost::instance = nullptr;
 
+	// the filter registered under the connection name, resolved here instead of per received message
+	template <typename Filters>
+	static void AttachFilter(const Filters& filters, NetTcp* c)
+	{
+		auto it = filters.find(c->GetName());
+		c->SetFilter(it != filters.end() ? it->second : nullptr);
+	}
+
 	void NetHost::Init()
 	{
 		Quit();
 		instance = new NetHost();
-
+		NetTcp::WakeOpen();
 	}
 
 	void NetHost::Quit()
 	{
 		delete instance;
 		instance = nullptr;
+		NetTcp::WakeClose();
 	}
 
 	void NetHost::ThreadRun()
@@ -62,8 +70,7 @@ namespace GAG
 	{
 		auto& io = ThreadIo();
 
-		std::chrono::time_point<std::chrono::system_clock, std::chrono::milliseconds> tp = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
-		int64_t now = (int64_t)tp.time_since_epoch().count();
+		int64_t now = NetTcp::Now();
 
 		for (;;)
 		{
@@ -85,6 +92,7 @@ namespace GAG
 					{
 						GAG::NetTcp* c = new GAG::NetTcp(kj::mv(msg.name), msg.addr);
 						connections[msg.id] = c;
+						AttachFilter(filters, c);
 						if (!c->Init(msg.id, now))
 						{
 							LogWarn("init err", msg.id, c->GetName().cStr());
@@ -106,21 +114,20 @@ namespace GAG
 					}
 					KJ_CASE_ONEOF(msg, NetControl::Close)
 					{
-						LogWarnFmt("lua_close id:%d now:%lld", msg.id, now/1000);
+						LogWarnFmt("lua_close id:%d now:%lld", msg.id, now/1000000);
 						auto con_ptr = FindConnection(msg.id);
 						SAFE_DELETE(con_ptr);
 						connections.erase(msg.id);
 					}
 					KJ_CASE_ONEOF(msg, NetControl::Filter)
 					{
-						auto name = kj::str(msg.name);
-						auto it = filters.find(name);
+						auto it = filters.find(msg.name);
 						if (it == filters.end())
 						{
 							if (msg.addFilter)
 							{
-								LogDebug("Filter Add", name, msg.addFilter, msg.delFilter);
-								filters.emplace(kj::str(name), msg.addFilter);
+								LogDebug("Filter Add", msg.name, msg.addFilter, msg.delFilter);
+								filters.emplace(kj::str(msg.name), msg.addFilter);
 							}
 						}
 						else
@@ -130,18 +137,28 @@ namespace GAG
 								msg.delFilter = it->second;
 								if (msg.addFilter)
 								{
-									LogDebug("Filter Replace", name, msg.addFilter, msg.delFilter);
-									msg.delFilter->FilterMessage(NetControl::Filter{ kj::str(name), msg.delFilter, msg.addFilter });
+									LogDebug("Filter Replace", msg.name, msg.addFilter, msg.delFilter);
+									msg.delFilter->FilterMessage(NetControl::Filter{ kj::str(msg.name), msg.delFilter, msg.addFilter });
 									it->second = msg.addFilter;
 								}
 								else
 								{
-									LogDebug("Filter Del", name, msg.addFilter, msg.delFilter);
-									msg.delFilter->FilterMessage(NetControl::Filter{ kj::str(name), msg.delFilter, msg.addFilter });
+									LogDebug("Filter Del", msg.name, msg.addFilter, msg.delFilter);
+									msg.delFilter->FilterMessage(NetControl::Filter{ kj::str(msg.name), msg.delFilter, msg.addFilter });
 									filters.erase(it);
 								}
 							}
 						}
+
+						// resolve once here, not per received message
+						for (auto& pair : connections)
+						{
+							if (pair.second->GetName() == msg.name)
+							{
+								AttachFilter(filters, pair.second);
+							}
+						}
+						auto name = kj::str(msg.name);
 						Rep(name, kj::mv(msg));
 					}
 					// OnAppPause
@@ -149,14 +166,45 @@ namespace GAG
 			}
 			else
 			{
+				static std::vector<NetTcp*> polled;
+				polled.clear();
+				for (auto& pair : connections)
+				{
+					polled.push_back(pair.second);
+				}
+				NetTcp::PollRead(polled, 0);
+
 				for (auto& pair : connections)
 				{
 					auto id = pair.first;
 					auto* c = pair.second;
 
+					c->Reconnect(id, now);
 					c->CheckTimeout(id, now);
 					c->ReceiveMsg(id, now);
+					c->EndPass(id);  // coalesced sends of this pass, and leftovers of a short send
+				}
+
+				// realtime connections: spin while one of them sent or received recently, then block on their sockets
+				bool realtime = false;
+				for (auto* c : polled)
+				{
+					if (c->IsSpinning(now))
+					{
+						io.provider->getTimer().afterDelay(0 * kj::MILLISECONDS).wait(io.waitScope);
+						return;
+					}
+					realtime = realtime || c->IsRealtime();
+				}
+
+				// wakes as soon as any socket is readable, or lua queues a request, instead of sleeping the full 3ms;
+				// a poll that could not wait sleeps below, or the thread would spin with nothing to do
+				if (realtime && NetTcp::PollRead(polled, 3) >= 0)
+				{
+					io.provider->getTimer().afterDelay(0 * kj::MILLISECONDS).wait(io.waitScope);
+					return;
 				}
+
 				io.provider->getTimer().afterDelay(3 * kj::MILLISECONDS).wait(io.waitScope);
 				return;
 			}
@@ -1,15 +1,24 @@
 #include "../utils/PCH.h"
+#include <capnp/serialize-packed.h>
+#include <chrono>
+#include <atomic>
 
 #include "NetTcp.h"
 #include "NetControl.h"
 #include "NetHost.h"
+#include "NetFilter.h"
+#include "NetCapture.h"
 
 #define IGNORE_SIGNAL(sig)				signal(sig, SIG_IGN)
 #define LOG_MOD							"NetTcp"
-#define RECV_PING_INTERVAL				4000
-#define SEND_PING_INTERVAL				3
+#define RECV_PING_INTERVAL				4000 * 1000		// us
+#define SEND_PING_INTERVAL				3				// s
 #define CONN_INTERVAL					10000
 #define MAX_PROTO_SIZE					50 * 1024 * 1024 
+#define RECV_CHUNK_SIZE					64 * 1024
+#define RECV_PASS_LIMIT					1024 * 1024		// bytes read from one socket per pass, so one busy peer can't starve the rest
+#define UNACKED_MAX						256				// requests kept for replay
+#define UNACKED_TIMEOUT					60 * 1000000	// us, a request older than this is not replayed
 
 #define NET_CONTROL_RECV(session, code)  NetHost::Control()->queueRep.Enqueue(NetControl::Recv{ id, 0, session, code, nullptr })
 #define NET_CONTROL_SEND(session, code)  NetHost::Control()->queueReq.Enqueue(NetControl::Send{ id, 0, session, code, nullptr })
@@ -41,13 +50,158 @@ typedef int socket_t;
 
 namespace GAG
 {
-	NetTcp::NetTcp(kj::String&& name, std::string& _addr) : name(kj::mv(name)), addr(_addr), status(Status::ConnectOK), client_timestamp(0), server_timestamp(0), last_recv_timestamp(0)
+	// frames drained by one ReceiveMsg, network thread only
+	static kj::Vector<NetControl::Rep> recvBatch;
+	static char recvChunk[RECV_CHUNK_SIZE];
+
+	// self-addressed udp socket, lua sends a byte to it, the network thread drains it in PollRead
+	static SOCKET wakeSocket = INVALID_SOCKET;
+	static std::atomic<bool> wakePending(false);
+
+	// connections asking for a cpu share one pin of the network thread, undone when the last of them closes
+	static int pinCount = 0;
+#ifdef _MSC_VER
+	static DWORD_PTR pinSaved = 0;
+#endif
+#ifdef __ANDROID__
+	static cpu_set_t pinSaved;
+#endif
+
+	// run a drained batch through the connection's filter, keeping the messages it does not take
+	static void FilterMessages(NetFilter* filter, kj::Vector<NetControl::Rep>& batch)
+	{
+		if (filter == nullptr)
+		{
+			return;
+		}
+
+		size_t keep = 0;
+		for (size_t i = 0; i < batch.size(); i++)
+		{
+			if (!filter->FilterMessage(kj::mv(batch[i])))
+			{
+				if (keep != i)
+					batch[keep] = kj::mv(batch[i]);
+				keep++;
+			}
+		}
+		batch.truncate(keep);
+	}
+
+	// undo the percent-escaping lopen applies to addr and option keys and values
+	static std::string Unescape(const std::string& s)
 	{
+		std::string out;
+		out.reserve(s.size());
+		for (size_t i = 0; i < s.size(); i++)
+		{
+			if (s[i] == '%' && i + 2 < s.size() && isxdigit((unsigned char)s[i + 1]) && isxdigit((unsigned char)s[i + 2]))
+			{
+				out += (char)strtol(s.substr(i + 1, 2).c_str(), nullptr, 16);
+				i += 2;
+			}
+			else
+			{
+				out += s[i];
+			}
+		}
+		return out;
+	}
+
+	NetTcp::NetTcp(kj::String&& name, std::string& _addr) : name(kj::mv(name)), addr(_addr), s_(INVALID_SOCKET), standby_s_(INVALID_SOCKET), status(Status::ConnectOK), client_timestamp(0), server_timestamp(0), last_recv_timestamp(0)
+	{
+		size_t position = addr.find('?');
+		if (position != std::string::npos)
+		{
+			ParseOptions(addr.substr(position + 1));
+			addr.erase(position);
+		}
+		addr = Unescape(addr);
+	}
+
+	void NetTcp::ParseOptions(const std::string& query)
+	{
+		size_t begin = 0;
+		while (begin < query.size())
+		{
+			size_t end = query.find('&', begin);
+			if (end == std::string::npos)
+				end = query.size();
+
+			std::string kv(query, begin, end - begin);
+			size_t eq = kv.find('=');
+			std::string key = Unescape(kv.substr(0, eq));
+			std::string value = eq == std::string::npos ? std::string() : Unescape(kv.substr(eq + 1));
+
+			if (key == "pack")
+				options.pack_threshold = (uint32_t)atoi(value.c_str());
+			else if (key == "coalesce")
+				options.coalesce = (uint32_t)atoi(value.c_str());
+			else if (key == "nodelay")
+				options.nodelay = atoi(value.c_str());
+			else if (key == "cork")
+				options.cork = atoi(value.c_str());
+			else if (key == "sndbuf")
+				options.sndbuf = atoi(value.c_str());
+			else if (key == "rcvbuf")
+				options.rcvbuf = atoi(value.c_str());
+			else if (key == "reconnect")
+				options.reconnect = atoi(value.c_str());
+			else if (key == "backoff")
+				options.backoff = atoi(value.c_str());
+			else if (key == "standby")
+				options.standby = atoi(value.c_str()) != 0;
+			else if (key == "capture")
+				options.capture = value;
+			else if (key == "class")
+				options.realtime = value == "realtime";
+			else if (key == "spin")
+				options.spin = atoi(value.c_str());
+			else if (key == "busypoll")
+				options.busy_poll = atoi(value.c_str());
+			else if (key == "cpu")
+				options.cpu = atoi(value.c_str());
+			else
+				LogWarn("ParseOptions unknown", name.cStr(), key.c_str());
+
+			begin = end + 1;
+		}
+	}
+
+	int64_t NetTcp::Now()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	int64_t NetTcp::WallNow()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	// min-rtt filter: the sample with the smallest rtt in the window has the least queueing skew in its offset
+	const NetTcp::ClockSample& NetTcp::AddClockSample(const ClockSample& sample)
+	{
+		clock_window[clock_count % CLOCK_WINDOW] = sample;
+		clock_count++;
+
+		int n = clock_count < CLOCK_WINDOW ? clock_count : CLOCK_WINDOW;
+		int best = 0;
+		for (int i = 1; i < n; i++)
+		{
+			if (clock_window[i].rtt < clock_window[best].rtt)
+				best = i;
+		}
+		return clock_window[best];
 	}
 
 	NetTcp::~NetTcp()
 	{
-		SocketClose();
+		SocketClose(s_);
+		if (standby_s_ != INVALID_SOCKET)
+		{
+			SocketClose(standby_s_);
+		}
+		UnpinThread();
 	}
 
 	NetTcp& NetTcp::operator=(NetTcp& o)
@@ -56,23 +210,128 @@ namespace GAG
 		return *this;
 	}
 
-	int NetTcp::SocketSetNonblock() 
+	int NetTcp::SocketSetNonblock(SOCKET s) 
 	{
 #ifdef _MSC_VER
 		u_long mode = 1;
-		return ioctlsocket(s_, FIONBIO, &mode);
+		return ioctlsocket(s, FIONBIO, &mode);
 #endif
 
 #ifdef __ANDROID__
-		int mode = fcntl(s_, F_GETFL, 0);
+		int mode = fcntl(s, F_GETFL, 0);
 		if (mode == SOCKET_ERROR)
 			return SOCKET_ERROR;
 		if (mode & O_NONBLOCK)
 			return 0;
-		return fcntl(s_, F_SETFL, mode | O_NONBLOCK);
+		return fcntl(s, F_SETFL, mode | O_NONBLOCK);
 #endif    
 	}
 
+	void NetTcp::SocketSetOptions(SOCKET s)
+	{
+		// coalescing already batches a pass into one send, nagle would only add delay on top
+		int nodelay = options.nodelay >= 0 ? options.nodelay : (options.coalesce > 0 ? 1 : -1);
+		if (peer.ss_family == AF_INET && nodelay >= 0)
+		{
+			int v = nodelay;
+			if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&v, sizeof(v)) < 0)
+				LogWarn("SocketSetOptions TCP_NODELAY error", s, name.cStr(), errno);
+		}
+
+		if (options.sndbuf > 0)
+		{
+			int v = options.sndbuf;
+			if (setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char*)&v, sizeof(v)) < 0)
+				LogWarn("SocketSetOptions SO_SNDBUF error", s, name.cStr(), errno);
+		}
+
+		if (options.rcvbuf > 0)
+		{
+			int v = options.rcvbuf;
+			if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char*)&v, sizeof(v)) < 0)
+				LogWarn("SocketSetOptions SO_RCVBUF error", s, name.cStr(), errno);
+		}
+
+#ifdef SO_BUSY_POLL
+		if (options.busy_poll > 0)
+		{
+			int v = options.busy_poll;
+			if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, (const char*)&v, sizeof(v)) < 0)
+				LogWarn("SocketSetOptions SO_BUSY_POLL error", s, name.cStr(), errno);
+		}
+#endif
+	}
+
+	// Init runs on the network thread, so this pins the one thread that serves every connection;
+	// the first connection to ask picks the cpu, later ones only take a reference
+	void NetTcp::PinThread(int cpu)
+	{
+		if (pinCount > 0)
+		{
+			LogDebug("PinThread already pinned", name.cStr(), cpu, pinCount);
+			pinned = true;
+			pinCount++;
+			return;
+		}
+
+#ifdef _MSC_VER
+		pinSaved = SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+		if (pinSaved == 0)
+		{
+			LogWarn("PinThread error", name.cStr(), cpu, (int)GetLastError());
+			return;
+		}
+#endif
+
+#ifdef __ANDROID__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_getaffinity(0, sizeof(pinSaved), &pinSaved) < 0 || sched_setaffinity(0, sizeof(set), &set) < 0)
+		{
+			LogWarn("PinThread error", name.cStr(), cpu, errno);
+			return;
+		}
+#endif
+		pinned = true;
+		pinCount++;
+	}
+
+	// destructor, on the network thread; the last pinned connection gives the thread its old affinity back
+	void NetTcp::UnpinThread()
+	{
+		if (!pinned)
+		{
+			return;
+		}
+		pinned = false;
+		if (--pinCount > 0)
+		{
+			return;
+		}
+
+#ifdef _MSC_VER
+		if (SetThreadAffinityMask(GetCurrentThread(), pinSaved) == 0)
+			LogWarn("UnpinThread error", name.cStr(), (int)GetLastError());
+#endif
+
+#ifdef __ANDROID__
+		if (sched_setaffinity(0, sizeof(pinSaved), &pinSaved) < 0)
+			LogWarn("UnpinThread error", name.cStr(), errno);
+#endif
+	}
+
+	// TCP_CORK only spans one pass: set with the first frame, cleared by EndPass so the tail goes out at once
+	void NetTcp::SetCork(bool on)
+	{
+		corked = on;
+#ifdef TCP_CORK
+		int v = on ? 1 : 0;
+		if (setsockopt(s_, IPPROTO_TCP, TCP_CORK, (const char*)&v, sizeof(v)) < 0)
+			LogWarn("SetCork error", s_, name.cStr(), on, errno);
+#endif
+	}
+
 	void NetTcp::SocketStart()
 	{
 #ifdef _MSC_VER
@@ -84,44 +343,100 @@ namespace GAG
 		IGNORE_SIGPIPE();
 	}
 
-	int NetTcp::SocketClose()
+	int NetTcp::SocketClose(SOCKET s)
 	{
 #ifdef _MSC_VER
-		LogWarn("SocketClose", s_, name.cStr());
-		return closesocket(s_);
+		LogWarn("SocketClose", s, name.cStr());
+		return closesocket(s);
 #endif
 
 #ifdef __ANDROID__
-		int ret = close(s_);
+		int ret = close(s);
 		if (ret == INVALID_SOCKET)
 		{
 			int err = errno;
 			LogWarn("SocketClose error ", err);
 			return err;
 		}
-		LogWarn("SocketClose", s_, name.cStr());
+		LogWarn("SocketClose", s, name.cStr());
 		return ret;
 #endif
 	}
 
+	SOCKET NetTcp::SocketOpen()
+	{
+		SOCKET s = socket(peer.ss_family, SOCK_STREAM, peer.ss_family == AF_INET ? IPPROTO_TCP : 0);
+		if (s == INVALID_SOCKET)
+		{
+			int err = errno;
+			LogWarn("SocketCreate error", INVALID_SOCKET, s, err, name.cStr());
+			return INVALID_SOCKET;
+		}
+
+		if (SocketSetNonblock(s) < 0)
+		{
+			LogWarn("SocketSetNonblock error");
+			SocketClose(s);
+			return INVALID_SOCKET;
+		}
+		SocketSetOptions(s);
+		return s;
+	}
+
 	bool NetTcp::Init(int id, int64_t& now)
 	{
 		SocketStart();
 
-		s_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (options.cpu >= 0)
+		{
+			PinThread(options.cpu);
+		}
+
+		if (!options.capture.empty())
+		{
+			capture = kj::heap<NetCapture>(options.capture);
+			if (!capture->IsOpen())
+			{
+				capture = nullptr;
+			}
+		}
+
+		if (addr.compare(0, 5, "unix:") == 0)
+		{
+			if (!ResolveUnix(addr.substr(5)))
+			{
+				return false;
+			}
+		}
+		else if (addr.compare(0, 4, "shm:") == 0)
+		{
+			LogWarn("Init shm transport not supported", name.cStr(), addr.c_str());
+			return false;
+		}
+		else if (!ResolveInet())
+		{
+			return false;
+		}
+
+		s_ = SocketOpen();
 		if (s_ == INVALID_SOCKET)
 		{
-			int err = errno;
-			LogWarn("SocketCreate error", INVALID_SOCKET, s_, err, name.cStr());
 			return false;
 		}
 
-		if (SocketSetNonblock() < 0)
+		int ret = SocketConnect(id, now);
+		if (ret < 0)
 		{
-			LogWarn("SocketSetNonblock error");
+			LogWarn("SocketConnect error", ret, s_, name.cStr());
 			return false;
 		}
 
+		return true;
+	}
+
+	// addr and peer are resolved once, reconnects reuse them
+	bool NetTcp::ResolveInet()
+	{
 		size_t position = addr.find(':');
 		std::string Ip(addr, 0, position);
 		std::string Port(addr, position + 1, addr.size());
@@ -133,31 +448,59 @@ namespace GAG
 			return false;
 		}
 
-		sockaddr_in saddr;
-		saddr.sin_family = AF_INET;
-		saddr.sin_port = htons(atoi(Port.c_str()));
-		saddr.sin_addr = *((in_addr *)he->h_addr);
-		memset(&(saddr.sin_zero), 0, 8);
+		sockaddr_t* saddr = (sockaddr_t*)&peer;
+		memset(&peer, 0, sizeof(peer));
+		saddr->sin_family = AF_INET;
+		saddr->sin_port = htons(atoi(Port.c_str()));
+		saddr->sin_addr = *((in_addr *)he->h_addr);
+		peer_len = sizeof(*saddr);
+		return true;
+	}
 
-		int ret = SocketConnect(&saddr, id, now);
-		if (ret < 0)
+	// "unix:/path/to/socket", or "unix:@name" for the linux abstract namespace
+	bool NetTcp::ResolveUnix(const std::string& path)
+	{
+#ifdef __ANDROID__
+		sockaddr_un* saddr = (sockaddr_un*)&peer;
+		memset(&peer, 0, sizeof(peer));
+		if (path.empty() || path.size() >= sizeof(saddr->sun_path))
 		{
-			LogWarn("SocketConnect error", ret, s_, name.cStr());
+			LogWarn("ResolveUnix bad path", name.cStr(), path.c_str());
 			return false;
 		}
 
+		saddr->sun_family = AF_UNIX;
+		memcpy(saddr->sun_path, path.c_str(), path.size());
+		peer_len = (socklen_t)(offsetof(sockaddr_un, sun_path) + path.size());
+		if (path[0] == '@')
+		{
+			saddr->sun_path[0] = '\0';
+		}
+		else
+		{
+			peer_len += 1;
+		}
 		return true;
+#else
+		LogWarn("ResolveUnix not supported", name.cStr(), path.c_str());
+		return false;
+#endif
 	}
 
-	int NetTcp::SocketConnect(const sockaddr_t * addr, int id, int64_t& now)
+	int NetTcp::SocketConnect(int id, int64_t& now)
 	{
+		int64_t deadline = Now() + (int64_t)CONN_INTERVAL * 1000;
 		// for EINTR
 		while (1)
 		{
-			int ret = connect(s_, (const struct sockaddr *)addr, sizeof(*addr));
+			int ret = connect(s_, (const struct sockaddr *)&peer, peer_len);
 			if (ret == 0)
 			{
-				status = NetTcp::Status::ConnectOK;
+				// unix sockets connect at once
+				OnConnected(id, now);
+				LogDebug("SocketConnect ok ", s_, name.cStr(), id);
+				//NetHost::Control()->queueRep.Enqueue(NetControl::Recv{ id, 0, (int)status, (int)status, nullptr });
+				NET_CONTROL_RECV((int)status, (int)status);
 				return 0;
 			}
 			else if (ret == -1)
@@ -168,6 +511,19 @@ namespace GAG
 					LogWarn("SocketConnect", s_, name.cStr(), ret, err);
 					continue;
 				}
+				else if (err == NET_EAGAIN && peer.ss_family == AF_UNIX)
+				{
+					// unix listen backlog full, no connect is pending; retry until CONN_INTERVAL
+					if (Now() >= deadline)
+					{
+						LogWarn("SocketConnect backlog full", s_, name.cStr(), ret, err);
+						status = NetTcp::Status::ConnectFail;
+						return -3;
+					}
+					struct timeval tv = { 0, 10 * 1000 };
+					select(0, nullptr, nullptr, nullptr, &tv);
+					continue;
+				}
 				else if (err != NET_EINPROGRESS)
 				{
 					LogWarn("SocketConnect", s_, name.cStr(), ret, err);
@@ -180,7 +536,7 @@ namespace GAG
 			}
 		}
 		
-		int ret = SocketSelectConnect(CONN_INTERVAL);
+		int ret = SocketSelectConnect(s_, CONN_INTERVAL);
 		if (ret <= 0)
 		{
 			status = NetTcp::Status::ConnectFail;
@@ -188,13 +544,7 @@ namespace GAG
 		}
 		else
 		{
-			status = NetTcp::Status::ConnectOK;
-			if (name != "login")
-			{
-				client_timestamp = now;
-				//NetHost::Control()->queueReq.Enqueue(NetControl::Send{ id, 0, 0, 0xFFFF, nullptr });
-				NET_CONTROL_SEND(0, 0xFFFF);
-			}
+			OnConnected(id, now);
 			LogDebug("SocketSelectConnect ok ", s_, name.cStr(), id, ret);
 		}
 		//NetHost::Control()->queueRep.Enqueue(NetControl::Recv{ id, 0, (int)status, (int)status, nullptr });
@@ -203,38 +553,307 @@ namespace GAG
 		return 0;
 	}
 
-	int NetTcp::SocketSelectConnect(int ms)
+	void NetTcp::OnConnected(int id, int64_t& now)
+	{
+		status = NetTcp::Status::ConnectOK;
+		last_recv_timestamp = now;
+		server_timestamp = 0;
+		corked = false;
+		ping_sent.clear();  // pings of the old socket are never answered
+		if (name != "login")
+		{
+			client_timestamp = now;
+			//NetHost::Control()->queueReq.Enqueue(NetControl::Send{ id, 0, 0, 0xFFFF, nullptr });
+			NET_CONTROL_SEND(0, 0xFFFF);
+		}
+		if (options.standby)
+		{
+			StartStandby();
+		}
+	}
+
+	int NetTcp::SocketSelectConnect(SOCKET s, int ms)
 	{
 		fd_set wset;
 		FD_ZERO(&wset);
-		FD_SET(s_, &wset);
+		FD_SET(s, &wset);
 		struct timeval tv = { ms / 1000 , 0};
 
-		int ret = select((int)s_ + 1, nullptr, &wset, nullptr, &tv);
+		int ret = select((int)s + 1, nullptr, &wset, nullptr, &tv);
 		if (ret <= 0)
 		{
 			int err = errno;
-			LogWarn("SocketSelectConnect err", s_, name.cStr(),ret, err);
+			LogWarn("SocketSelectConnect err", s, name.cStr(),ret, err);
 			return ret;
 		}
 
-		if (FD_ISSET(s_, &wset))
+		if (FD_ISSET(s, &wset))
 		{
 			int error;
 			socklen_t error_len = sizeof(error);
-			ret = getsockopt(s_, SOL_SOCKET, SO_ERROR, (char*)&error, &error_len);
+			ret = getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&error, &error_len);
 			if (ret == -1 || error != 0)
 			{
-				LogWarn("SocketSelectConnect err", s_, name.cStr(), ret, error);
+				LogWarn("SocketSelectConnect err", s, name.cStr(), ret, error);
 				return -4;
 			}
 		}
 		return 1;
 	}
 
+	// 1 connected, 0 in progress, 2 unix backlog full and nothing pending (call again later), -1 failed
+	int NetTcp::SocketConnectStart(SOCKET s)
+	{
+		for (;;)
+		{
+			int ret = connect(s, (const struct sockaddr *)&peer, peer_len);
+			if (ret == 0)
+			{
+				return 1;
+			}
+
+			int err = errno;
+			if (err == NET_EINTR)
+			{
+				continue;
+			}
+			if (err == NET_EAGAIN && peer.ss_family == AF_UNIX)
+			{
+				return 2;
+			}
+			if (err == NET_EINPROGRESS)
+			{
+				return 0;
+			}
+			LogWarn("SocketConnectStart err", s, name.cStr(), err);
+			return -1;
+		}
+	}
+
+	// non-blocking check of a connect started by SocketConnectStart: 1 connected, 0 in progress, -1 failed
+	int NetTcp::SocketPollConnect(SOCKET s)
+	{
+		fd_set wset;
+		FD_ZERO(&wset);
+		FD_SET(s, &wset);
+		struct timeval tv = { 0, 0 };
+
+		int ret = select((int)s + 1, nullptr, &wset, nullptr, &tv);
+		if (ret == 0)
+		{
+			return 0;
+		}
+		if (ret < 0)
+		{
+			int err = errno;
+			return err == NET_EINTR ? 0 : -1;
+		}
+
+		int error;
+		socklen_t error_len = sizeof(error);
+		ret = getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&error, &error_len);
+		if (ret == -1 || error != 0)
+		{
+			LogWarn("SocketPollConnect err", s, name.cStr(), ret, error);
+			return -1;
+		}
+		return 1;
+	}
+
+	// connect a second socket in the background, a failover takes it instead of connecting again
+	void NetTcp::StartStandby()
+	{
+		if (standby_s_ != INVALID_SOCKET)
+		{
+			return;
+		}
+
+		// the standby is optional, a full unix backlog just means going without it
+		standby_s_ = SocketOpen();
+		if (standby_s_ == INVALID_SOCKET)
+		{
+			return;
+		}
+
+		int ret = SocketConnectStart(standby_s_);
+		if (ret < 0 || ret == 2)
+		{
+			SocketClose(standby_s_);
+			standby_s_ = INVALID_SOCKET;
+		}
+	}
+
+	// a finished connect only says it was accepted once; a peer that idle-closed it since leaves EOF to read
+	bool NetTcp::StandbyAlive()
+	{
+		if (SocketPollConnect(standby_s_) <= 0)
+		{
+			return false;
+		}
+
+		fd_set rset;
+		FD_ZERO(&rset);
+		FD_SET(standby_s_, &rset);
+		struct timeval tv = { 0, 0 };
+		if (select((int)standby_s_ + 1, &rset, nullptr, nullptr, &tv) > 0)
+		{
+			char c;
+			int rv = recv(standby_s_, &c, 1, MSG_PEEK);
+			if (rv == 0)
+			{
+				return false;
+			}
+			if (rv < 0)
+			{
+				int err = errno;
+				if (err != NET_EWOULDBLOCK && err != NET_EAGAIN)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	void NetTcp::Fail(int id, Status s)
+	{
+		bool was_ok = status == Status::ConnectOK;
+		status = s;
+		if (options.reconnect > 0 && reconnect_count < options.reconnect)
+		{
+			// keep quiet while reconnecting, lua only hears about it when all attempts are spent
+			LogWarn("Fail reconnect", id, name.cStr(), (int)status);
+			if (was_ok)
+			{
+				send_buffer.clear();  // may start with a half sent frame, requests in it are replayed from unacked
+			}
+			return;
+		}
+		//NetHost::Control()->queueRep.Enqueue(NetControl::Recv{ id, false, (int)status, (int)status, nullptr });
+		NET_CONTROL_RECV((int)status, (int)status);
+	}
+
+	bool NetTcp::Reconnect(int id, int64_t& now)
+	{
+		if (options.reconnect == 0 || status == Status::ConnectOK)
+		{
+			return false;
+		}
+
+		if (status == Status::ConnectIng)
+		{
+			// connect started by an earlier pass, never wait on it here
+			int ret = connect_retry ? SocketConnectStart(s_) : SocketPollConnect(s_);
+			if (ret == 2)
+			{
+				ret = 0;
+			}
+			else if (connect_retry && ret == 0)
+			{
+				connect_retry = false;
+			}
+			if (ret > 0)
+			{
+				OnReconnected(id, now);
+				return true;
+			}
+			if (ret == 0 && now < connect_deadline)
+			{
+				return false;
+			}
+			status = Status::ConnectFail;
+			ReconnectFailed(id);
+			return false;
+		}
+
+		if (reconnect_count >= options.reconnect || now < reconnect_at)
+		{
+			return false;
+		}
+
+		reconnect_count++;
+		reconnect_at = now + (int64_t)options.backoff * 1000 * (1 << std::min(reconnect_count - 1, 6));
+
+		SocketClose(s_);
+		s_ = INVALID_SOCKET;
+		recv_buffer.clear();
+
+		if (standby_s_ != INVALID_SOCKET)
+		{
+			if (StandbyAlive())
+			{
+				s_ = standby_s_;
+				standby_s_ = INVALID_SOCKET;
+				OnReconnected(id, now);
+				return true;
+			}
+			SocketClose(standby_s_);
+			standby_s_ = INVALID_SOCKET;
+		}
+
+		s_ = SocketOpen();
+		int ret = s_ == INVALID_SOCKET ? -1 : SocketConnectStart(s_);
+		if (ret > 0)
+		{
+			OnReconnected(id, now);
+			return true;
+		}
+		if (ret == 0 || ret == 2)
+		{
+			status = Status::ConnectIng;
+			connect_retry = ret == 2;
+			connect_deadline = now + (int64_t)CONN_INTERVAL * 1000;
+			return false;
+		}
+
+		status = Status::ConnectFail;
+		ReconnectFailed(id);
+		return false;
+	}
+
+	void NetTcp::ReconnectFailed(int id)
+	{
+		LogWarn("Reconnect fail", id, name.cStr(), reconnect_count, options.reconnect);
+		if (reconnect_count >= options.reconnect)
+		{
+			//NetHost::Control()->queueRep.Enqueue(NetControl::Recv{ id, false, (int)status, (int)status, nullptr });
+			NET_CONTROL_RECV((int)status, (int)status);
+		}
+	}
+
+	void NetTcp::OnReconnected(int id, int64_t& now)
+	{
+		readable = true;
+		proving = true;  // attempts and backoff are only reset once a frame arrives on the new link
+		OnConnected(id, now);
+		LogWarn("Reconnect ok", id, name.cStr(), reconnect_count, unacked.size());
+
+		// unanswered requests first, then the other frames queued while the link was down
+		std::string queued;
+		queued.swap(send_buffer);
+		for (auto& u : unacked)
+		{
+			send_buffer += u.frame;
+		}
+		send_buffer += queued;
+		Flush(id);
+	}
+
+	// a response that never comes must not pin its request forever
+	void NetTcp::AddUnacked(int session, const char* frame, size_t size)
+	{
+		int64_t now = Now();
+		while (!unacked.empty() && (unacked.size() >= UNACKED_MAX || now - unacked.front().sent_at > UNACKED_TIMEOUT))
+		{
+			LogWarn("AddUnacked drop", name.cStr(), unacked.front().session, unacked.size());
+			unacked.erase(unacked.begin());
+		}
+		unacked.push_back(Unacked{ session, now, std::string(frame, size) });
+	}
+
 	void NetTcp::SendMsg(int id, bool response, int session, int code, kj::Array<const capnp::word>&& data)
 	{
-		if (s_ == INVALID_SOCKET || status != Status::ConnectOK)
+		// while reconnecting frames are queued for the new socket, a ping is pointless there
+		bool down = s_ == INVALID_SOCKET || status != Status::ConnectOK;
+		if (down && (!Reconnecting() || (session == 0 && code == 0xFFFF)))
 		{
 			LogWarn("SendMsg err", s_, name.cStr(), (int)status);
 			return;
@@ -245,19 +864,106 @@ namespace GAG
 			session = session | 0x8000;
 		}
 
+		if (options.realtime && !(session == 0 && code == 0xFFFF))
+		{
+			last_send_timestamp = Now();
+		}
+
 		auto size = data.size() * sizeof(data[0]);
+		uint32_t flag = 0;
+		kj::Array<kj::byte> packed;
+		if (options.pack_threshold > 0 && size >= options.pack_threshold && !(session == 0 && code == 0xFFFF))
+		{
+			// [u32 unpacked words][packed words], receiver unpacks straight into its word array
+			kj::VectorOutputStream out(size / 2 + sizeof(uint32_t));
+			uint32_t words = htonl((uint32_t)data.size());
+			out.write(&words, sizeof(words));
+			{
+				capnp::_::PackedOutputStream packer(out);
+				packer.write(data.begin(), size);
+			}
+
+			auto bytes = out.getArray();
+			if (bytes.size() < size)
+			{
+				packed = kj::heapArray<kj::byte>(bytes);
+				size = packed.size();
+				flag = SIZE_FLAG_PACKED;
+			}
+		}
+
+		if (!response && session == 0 && code == 0xFFFF)
+		{
+			ping_sent.push_back(Now());
+		}
+
 		NetHeader h;
 		uint32_t hsize = (uint32_t)(size + sizeof(h) - sizeof(h.size));
-		h.size = htonl(hsize);
+		h.size = htonl(hsize | flag);
 		h.code = code;
 		h.session = response ? session | 0x8000 : session & 0x7FFF;
 
 		std::string str_header((char*)&h, sizeof(h));
 		send_buffer += str_header;
 
-		size = data.size() * sizeof(data[0]);
-		std::string str_body((char*)data.begin(), size);
-		send_buffer += str_body;
+		if (flag)
+		{
+			send_buffer.append((const char*)packed.begin(), packed.size());
+		}
+		else
+		{
+			send_buffer.append((const char*)data.begin(), size);
+		}
+
+		size_t frame_size = size + sizeof(h);
+		const char* frame = send_buffer.c_str() + send_buffer.size() - frame_size;
+		if (capture)
+		{
+			capture->Write(NetCapture::Out, Now(), frame, frame_size);
+		}
+
+		bool request = !response && session != 0;
+		if (options.reconnect > 0 && request)
+		{
+			// kept until the response arrives, replayed on a new socket after a failover
+			AddUnacked(session & 0x7FFF, frame, frame_size);
+		}
+
+		if (down)
+		{
+			if (request)
+			{
+				send_buffer.resize(send_buffer.size() - frame_size);  // already in unacked
+			}
+			return;
+		}
+
+		if (options.cork > 0 && !corked && peer.ss_family == AF_INET)
+		{
+			SetCork(true);
+		}
+
+		if (options.coalesce == 0 || send_buffer.size() >= options.coalesce)
+		{
+			Flush(id);
+		}
+	}
+
+	void NetTcp::EndPass(int id)
+	{
+		Flush(id);
+		if (corked && s_ != INVALID_SOCKET)
+		{
+			SetCork(false);
+		}
+	}
+
+	void NetTcp::Flush(int id)
+	{
+		if (send_buffer.empty() || s_ == INVALID_SOCKET || status != Status::ConnectOK)
+		{
+			return;
+		}
 
 		int sendlen = send(s_, send_buffer.c_str(), (int)send_buffer.size(), 0);
 		if (sendlen <= 0)
@@ -265,10 +971,8 @@ namespace GAG
 			int err = errno;
 			if (err != NET_EWOULDBLOCK && err != NET_EAGAIN)
 			{
-				LogWarn("SendMsg err", sendlen, err);
-				status = Status::NetError;
-				//NetHost::Control()->queueRep.Enqueue(NetControl::Recv{ id, false, (int)status, (int)status, nullptr });
-				NET_CONTROL_RECV((int)status, (int)status);
+				LogWarn("Flush err", sendlen, err);
+				Fail(id, Status::NetError);
 			}
 		}
 		else
@@ -277,60 +981,215 @@ namespace GAG
 		}
 	}
 
-	bool NetTcp::ReceiveMsg(int id, int64_t& now)
+	int NetTcp::PollRead(std::vector<NetTcp*>& conns, int ms)
 	{
-		if (s_ == INVALID_SOCKET || status != Status::ConnectOK)
+		fd_set rset;
+		FD_ZERO(&rset);
+		SOCKET maxfd = 0;
+		int count = 0;
+		bool fallback = false;
+		for (auto* c : conns)
 		{
-			return false;
+			c->readable = false;
+			if (c->s_ == INVALID_SOCKET || c->status != Status::ConnectOK)
+				continue;
+#ifdef __ANDROID__
+			if (c->s_ >= FD_SETSIZE)
+				fallback = true;
+#endif
+			if (++count > FD_SETSIZE)
+				fallback = true;
+			if (fallback)
+				break;
+			FD_SET(c->s_, &rset);
+			maxfd = std::max(maxfd, c->s_);
 		}
 
-		if (CheckMessageComplete(id))
+		// only a blocking poll waits on the wake socket, a zero timeout one leaves its byte for the next block
+		bool wake = ms > 0 && wakeSocket != INVALID_SOCKET && !fallback && count < FD_SETSIZE;
+		if (wake)
 		{
-			DispatchMessage(id, now);
-			return true;
+			FD_SET(wakeSocket, &rset);
+			maxfd = std::max(maxfd, wakeSocket);
 		}
 
-		char buf[1024];
-		memset(buf, 0, 1024);
-		int rv = recv(s_, buf, 1024, 0);
-		std::string t;
+		int ret = 0;
+		if (!fallback && (count > 0 || wake))
+		{
+			struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+			ret = select((int)maxfd + 1, &rset, nullptr, nullptr, &tv);
+			if (ret < 0)
+			{
+				int err = errno;
+				if (err != NET_EINTR)
+					LogWarn("PollRead select err", ret, err);
+				fallback = true;
+			}
+			else if (wake && FD_ISSET(wakeSocket, &rset))
+			{
+				// clear first, a Wake racing the drain then costs one spurious wake instead of a lost one
+				wakePending = false;
+				char buf[64];
+				while (recv(wakeSocket, buf, sizeof(buf), 0) > 0)
+				{
+				}
+				ret--;
+			}
+		}
 
-		if (rv == 0)
+		// old path: try recv on every connection
+		for (auto* c : conns)
 		{
-			LogWarn("ReceiveMsg ret=0", id);
-			status = Status::CloseByPeer;
-			//NetHost::Control()->queueRep.Enqueue(NetControl::Recv{ id, false, (int)status, (int)status, nullptr });
-			NET_CONTROL_RECV((int)status, (int)status);
-			return true;
+			c->readable = fallback || (c->s_ != INVALID_SOCKET && c->status == Status::ConnectOK && FD_ISSET(c->s_, &rset));
+		}
+		return fallback || (count == 0 && !wake) ? -1 : ret;
+	}
+
+	// called from NetHost::Init before the network thread runs, so Wake never sees it half made
+	void NetTcp::WakeOpen()
+	{
+		WakeClose();
+		SocketStart();
+
+		SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (s == INVALID_SOCKET)
+		{
+			LogWarn("WakeOpen socket error", errno);
+			return;
 		}
-		else if (rv < 0)
+
+		sockaddr_t saddr;
+		socklen_t len = sizeof(saddr);
+		memset(&saddr, 0, sizeof(saddr));
+		saddr.sin_family = AF_INET;
+		saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		saddr.sin_port = 0;
+#ifdef _MSC_VER
+		u_long mode = 1;
+		int nonblock = ioctlsocket(s, FIONBIO, &mode);
+#endif
+#ifdef __ANDROID__
+		int nonblock = fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+		// connected to its own port, send and recv need no address and nothing else can reach it
+		if (nonblock < 0
+			|| bind(s, (const struct sockaddr *)&saddr, sizeof(saddr)) != 0
+			|| getsockname(s, (struct sockaddr *)&saddr, &len) != 0
+			|| connect(s, (const struct sockaddr *)&saddr, sizeof(saddr)) != 0)
 		{
-			int error = errno;
-			if (error != NET_EWOULDBLOCK && error != NET_EAGAIN)
+			LogWarn("WakeOpen error", errno);
+#ifdef _MSC_VER
+			closesocket(s);
+#endif
+#ifdef __ANDROID__
+			close(s);
+#endif
+			return;
+		}
+		wakePending = false;
+		wakeSocket = s;
+	}
+
+	void NetTcp::WakeClose()
+	{
+		if (wakeSocket == INVALID_SOCKET)
+		{
+			return;
+		}
+#ifdef _MSC_VER
+		closesocket(wakeSocket);
+#endif
+#ifdef __ANDROID__
+		close(wakeSocket);
+#endif
+		wakeSocket = INVALID_SOCKET;
+	}
+
+	// lua thread, after each Enqueue; one byte stays pending until PollRead drains it
+	void NetTcp::Wake()
+	{
+		if (wakeSocket != INVALID_SOCKET && !wakePending.exchange(true))
+		{
+			char b = 0;
+			send(wakeSocket, &b, 1, 0);
+		}
+	}
+
+	bool NetTcp::ReceiveMsg(int id, int64_t& now)
+	{
+		if (s_ == INVALID_SOCKET || status != Status::ConnectOK)
+		{
+			return false;
+		}
+
+		// a failure is only reported after the frames read before it are delivered
+		Status failure = Status::ConnectOK;
+		if (readable && !CheckMessageComplete(id, failure) && failure == Status::ConnectOK)
+		{
+			readable = false;
+			// drain the socket up to RECV_PASS_LIMIT, a short read means the kernel buffer is empty
+			for (size_t total = 0; total < RECV_PASS_LIMIT;)
 			{
-				LogWarn("ReceiveMsg ret=-1 ", rv, error);
-				status = Status::NetError;
-				//NetHost::Control()->queueRep.Enqueue(NetControl::Recv{ id, false, (int)status, (int)status, nullptr });
-				NET_CONTROL_RECV((int)status, (int)status);
+				int rv = recv(s_, recvChunk, RECV_CHUNK_SIZE, 0);
+
+				if (rv == 0)
+				{
+					LogWarn("ReceiveMsg ret=0", id);
+					failure = Status::CloseByPeer;
+					break;
+				}
+				else if (rv < 0)
+				{
+					int error = errno;
+					if (error != NET_EWOULDBLOCK && error != NET_EAGAIN)
+					{
+						LogWarn("ReceiveMsg ret=-1 ", rv, error);
+						failure = Status::NetError;
+					}
+					break;
+				}
+
+				recv_buffer.append(recvChunk, rv);
+				last_recv_timestamp = now;
+				total += rv;
+				//LogDebug("recv_per", id, rv, recv_buffer.size());
+				if (rv < RECV_CHUNK_SIZE)
+					break;
 			}
-			return false;
 		}
 
-		t.assign(buf, rv);
-		recv_buffer += t;
-		last_recv_timestamp = now;
-		//LogDebug("recv_per", id, t.size(), recv_buffer.size());
+		// a bad frame stops dispatch, the good ones before it still go out first
+		while (failure == Status::ConnectOK && CheckMessageComplete(id, failure))
+		{
+			DispatchMessage(id, now, failure);
+		}
 
-		if (!CheckMessageComplete(id))
+		bool delivered = DeliverMessages();
+		if (failure != Status::ConnectOK && status == Status::ConnectOK)
+		{
+			Fail(id, failure);
+			return true;
+		}
+		return delivered;
+	}
+
+	bool NetTcp::DeliverMessages()
+	{
+		if (recvBatch.empty())
 		{
 			return false;
 		}
 
-		DispatchMessage(id, now);
+		FilterMessages(filter, recvBatch);
+		for (auto& rep : recvBatch)
+		{
+			NetHost::Control()->queueRep.Enqueue(kj::mv(rep));
+		}
+		recvBatch.clear();
 		return true;
 	}
 
-	bool NetTcp::CheckMessageComplete(int id)
+	bool NetTcp::CheckMessageComplete(int id, Status& failure)
 	{
 		if (recv_buffer.size() < 4)
 		{
@@ -342,13 +1201,13 @@ namespace GAG
 			(unsigned char)recv_buffer[1] * (1 << 16) +
 			(unsigned char)recv_buffer[2] * (1 << 8) +
 			(unsigned char)recv_buffer[3];
+		packsize &= SIZE_MASK;
 
-		if (packsize > MAX_PROTO_SIZE)
+		// shorter than its own header would make the body length negative
+		if (packsize > MAX_PROTO_SIZE || packsize < sizeof(NetHeader) - sizeof(NetHeader::size))
 		{
 			LogWarn("CheckMessageComplete", id, packsize, recv_buffer.size());
-			status = Status::NetError;
-			//NetHost::Control()->queueRep.Enqueue(NetControl::Recv{ id, false, (int)status, (int)status, nullptr });
-			NET_CONTROL_RECV((int)status, (int)status);
+			failure = Status::NetError;
 			return false;
 		}
 
@@ -361,7 +1220,37 @@ namespace GAG
 		return true;
 	}
 
-	void NetTcp::DispatchMessage(int id, int64_t& now)
+	bool NetTcp::UnpackBody(const char* body, size_t size, kj::Array<capnp::word>& data)
+	{
+		if (size < sizeof(uint32_t))
+		{
+			return false;
+		}
+
+		uint32_t words;
+		memcpy(&words, body, sizeof(words));
+		words = ntohl(words);
+		if ((uint64_t)words * sizeof(capnp::word) > MAX_PROTO_SIZE)
+		{
+			return false;
+		}
+
+		data = kj::heapArray<capnp::word>(words);
+		KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]()
+		{
+			kj::ArrayInputStream in(kj::arrayPtr((const kj::byte*)body + sizeof(words), size - sizeof(words)));
+			capnp::_::PackedInputStream unpacker(in);
+			unpacker.read(data.begin(), data.size() * sizeof(capnp::word));
+		}))
+		{
+			LogWarn("UnpackBody err", name.cStr(), words, size, e->getDescription().cStr());
+			data = nullptr;
+			return false;
+		}
+		return true;
+	}
+
+	void NetTcp::DispatchMessage(int id, int64_t& now, Status& failure)
 	{
 		bool side = false;
 		int session = 0;
@@ -370,50 +1259,95 @@ namespace GAG
 		kj::Array<capnp::word> data;
 		NetHeader* header = (NetHeader*)(recv_buffer.c_str());
 
-		header->size = ntohl(header->size);
+		uint32_t hsize = ntohl(header->size);
+		bool packed = (hsize & SIZE_FLAG_PACKED) != 0;
+		// CheckMessageComplete keeps the masked size within [header rest, MAX_PROTO_SIZE]
+		size_t body = (hsize & SIZE_MASK) + sizeof(header->size) - sizeof(NetHeader);
 		side = (header->session & 0x8000) != 0;
 		session = header->session & 0x7FFF;
 		code = header->code;
-		size = (header->size - sizeof(NetHeader) + sizeof(header->size)) / sizeof(capnp::word);
+		size = (int)(body / sizeof(capnp::word));
 
-		if (size > 0)
+		if (packed)
+		{
+			if (!UnpackBody(recv_buffer.c_str() + sizeof(NetHeader), body, data))
+			{
+				failure = Status::NetError;
+				return;
+			}
+		}
+		else if (size > 0)
 		{
 			// decide on ping, session = 0, code = 0xFFFF; data_size = sizeof(int64_t)
 			if (session == 0 && code == 0xFFFF)
 			{
 				int64_t* timestamp_arr = (int64_t*)(recv_buffer.c_str() + sizeof(NetHeader));
-				data = kj::heapArray<capnp::word>(size + sizeof(double) / sizeof(capnp::word));
+				int64_t recv_at = Now();
+				int64_t sent_at = client_timestamp;
+				if (!ping_sent.empty())
+				{
+					sent_at = ping_sent.front();
+					ping_sent.pop_front();
+				}
+				ClockSample sample;
+				sample.rtt = recv_at - sent_at;
+				sample.offset = timestamp_arr[0] / 1000.0 - (WallNow() - sample.rtt / 2) / 1000000.0;
+				const ClockSample& best = AddClockSample(sample);
+
+				// filtered offset, rtt, min rtt of the window, raw offset; all in seconds
+				data = kj::heapArray<capnp::word>(4 * sizeof(double) / sizeof(capnp::word));
 				double* data_arr = (double*)data.begin();
-				data_arr[0] = (timestamp_arr[0] - (now + client_timestamp) / 2.0) / 1000.0;
-				data_arr[1] = (now - client_timestamp) / 1000.0;
+				data_arr[0] = best.offset;
+				data_arr[1] = sample.rtt / 1000000.0;
+				data_arr[2] = best.rtt / 1000000.0;
+				data_arr[3] = sample.offset;
 				server_timestamp = now;
-				LogWarn("RecvPing", timestamp_arr[0], data_arr[1], now / 1000);
+				LogWarn("RecvPing", timestamp_arr[0], data_arr[0], data_arr[1], now / 1000000);
 			}
 			else
 			{
 				data = kj::heapArray<capnp::word>(size);
 				if (recv_buffer.size() < sizeof(NetHeader) + size * sizeof(capnp::word))
 				{
-					status = Status::NetError;
-					//NetHost::Control()->queueRep.Enqueue(NetControl::Recv{ id, false, (int)status, (int)status, nullptr });
-					NET_CONTROL_RECV((int)status, (int)status);
+					failure = Status::NetError;
+					return;
 				}
 				memcpy(data.begin(), recv_buffer.c_str() + sizeof(NetHeader), size * sizeof(capnp::word));
 			}
 		}
 
-		int dec = size * sizeof(capnp::word) + sizeof(NetHeader);
+		// only a frame that decoded counts as proof of the link, or answers a request
+		if (proving)
+		{
+			// the new link carried a frame, a later failure starts from a fresh backoff again
+			proving = false;
+			reconnect_count = 0;
+			reconnect_at = 0;
+		}
+
+		if (side && !unacked.empty())
+		{
+			auto it = std::find_if(unacked.begin(), unacked.end(), [session](const Unacked& u) { return u.session == session; });
+			if (it != unacked.end())
+			{
+				unacked.erase(it);
+			}
+		}
+
+		size_t dec = (packed ? body : size * sizeof(capnp::word)) + sizeof(NetHeader);
+		if (capture)
+		{
+			capture->Write(NetCapture::In, Now(), recv_buffer.c_str(), dec);
+		}
 		recv_buffer.erase(0, dec);
 		//LogDebug("recv_clear_buffer", id, recv_buffer.size(), dec);
 
-		//maybe filter
-		NetControl::Rep rep = NetControl::Recv{ id, side, session, code, data.size() ? kj::mv(data) : nullptr };
-		NetHost::instance->Rep(GetName(), kj::mv(rep));
+		recvBatch.add(NetControl::Recv{ id, side, session, code, data.size() ? kj::mv(data) : nullptr });
 	}
 
 	bool NetTcp::CheckTimeout(int id, int64_t& now)
 	{
-		if (status == Status::Timeout)
+		if (status != Status::ConnectOK)
 		{
 			return false;
 		}
@@ -428,10 +1362,8 @@ namespace GAG
 			return false;
 		}
 
-		status = NetTcp::Status::Timeout;
-		//NetHost::Control()->queueRep.Enqueue(NetControl::Recv{ id, 0, (int)status, (int)status, nullptr });
-		NET_CONTROL_RECV((int)status, (int)status);
-		LogWarn("CheckTimeout", id, last_recv_timestamp/1000, client_timestamp/1000, server_timestamp/1000, now/1000);
+		Fail(id, Status::Timeout);
+		LogWarn("CheckTimeout", id, last_recv_timestamp/1000000, client_timestamp/1000000, server_timestamp/1000000, now/1000000);
 
 		return true;
 	}
@@ -443,13 +1375,13 @@ namespace GAG
 			return;
 		}
 
-		int64_t interval = (now - client_timestamp) / 1000;
+		int64_t interval = (now - client_timestamp) / 1000000;
 		if (interval > 0 && interval % SEND_PING_INTERVAL == 0)
 		{
 			client_timestamp = now;
 			//NetHost::Control()->queueReq.Enqueue(NetControl::Send{ id, 0, 0, 0xFFFF, nullptr });
 			NET_CONTROL_SEND(0, 0xFFFF);
-			//LogWarn("SendPing", id, interval, now/1000, (client_timestamp - server_timestamp)/1000, (now - last_recv_timestamp)/1000);
+			//LogWarn("SendPing", id, interval, now/1000000, (client_timestamp - server_timestamp)/1000000, (now - last_recv_timestamp)/1000000);
 		}
 	}
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include "NetHeader.h"
+#include <deque>
 
 #ifdef _MSC_VER
 #include <WinSock2.h> //for htonl ntohl
@@ -15,16 +16,25 @@ static inline void _socket_start(void) { WSACleanup(); }
 #ifdef __ANDROID__
 #include <fcntl.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <sched.h>
 typedef int SOCKET;
 #endif
 
 // 目前通用的tcp udp v4地址
 typedef struct sockaddr_in sockaddr_t;  // 与sockaddr 有区别
 
+#define SIZE_FLAG_PACKED				0x80000000u		// high bit of NetHeader::size, body is [u32 words][capnp packed]
+#define SIZE_MASK						0x7FFFFFFFu
+
 namespace GAG
 {
+	class NetFilter;
+	class NetCapture;
+
 	class NetTcp
 	{
 	public:
@@ -38,17 +48,54 @@ namespace GAG
 			CloseByPeer = -5,
 		};
 
+		// per connection options, passed from lopen as "host:port?key=value&key=value", addr, keys and values percent-escaped
+		struct Options
+		{
+			uint32_t pack_threshold = 0; // capnp pack frame bodies >= this many bytes, 0 = off
+			uint32_t coalesce = 0;		 // buffer sends until Flush or this many bytes, 0 = send at once
+			int nodelay = -1;			 // TCP_NODELAY, -1 = on when coalescing, else system default
+			int cork = -1;				 // TCP_CORK per pass where supported, 1 = on
+			int sndbuf = 0;				 // SO_SNDBUF, 0 = leave system default
+			int rcvbuf = 0;				 // SO_RCVBUF
+			int reconnect = 0;			 // attempts after a failure before lua is told, 0 = off
+			int backoff = 200;			 // ms before the next attempt, doubled per failed attempt
+			bool standby = false;		 // keep a second socket connected for failover
+			std::string capture;		 // record every frame in and out to this file
+			bool realtime = false;		 // class=realtime: NetHost spins instead of sleeping while it has traffic
+			int spin = 2000;			 // us after the last send or receive that a realtime connection keeps NetHost spinning
+			int busy_poll = 0;			 // SO_BUSY_POLL us where supported
+			int cpu = -1;				 // pin the network thread to this cpu
+		};
+
 		NetTcp() {}
 		explicit NetTcp(kj::String&& name, std::string& addr);
 		~NetTcp();
 		NetTcp& operator=(NetTcp&);
 
+		static int64_t Now();	  // steady clock, us
+		static int64_t WallNow(); // system clock, us
+
 		const kj::String& GetName() const { return name; }
+		bool IsRealtime() const { return options.realtime; }
+		bool IsSpinning(int64_t now) const { return options.realtime && status == Status::ConnectOK && now - std::max(last_recv_timestamp, last_send_timestamp) < options.spin; }
+		void SetFilter(NetFilter* f) { filter = f; }
 		bool Init(int id, int64_t& now);
 
 		void SendMsg(int id, bool response, int session, int code, kj::Array<const capnp::word>&& data);
+		void Flush(int id);
+		void EndPass(int id);	// flush what the pass queued and uncork
 		bool ReceiveMsg(int id, int64_t& now);
 
+		// one select over all connections, marks which ones ReceiveMsg should read;
+		// -1 when it did not wait: it fell back to reading all, or had no socket to select on
+		static int PollRead(std::vector<NetTcp*>& conns, int ms);
+
+		// loopback socket PollRead also waits on when it blocks, so lua can wake the network thread after an Enqueue
+		static void WakeOpen();
+		static void WakeClose();
+		static void Wake();
+
+		bool Reconnect(int id, int64_t& now);
 		bool CheckTimeout(int id, int64_t& now);
 		void SendPing(int id, int64_t& now);
 
@@ -56,24 +103,79 @@ namespace GAG
 
 		kj::String	name;
 		std::string addr;
+		Options		options;
+		NetFilter*	filter = nullptr; // resolved when a filter is attached
+		kj::Own<NetCapture> capture;
 
 		SOCKET s_;
+		SOCKET standby_s_;
+		sockaddr_storage peer;
+		socklen_t peer_len = 0;
+		int reconnect_count = 0;
+		int64_t reconnect_at = 0;
+		int64_t connect_deadline = 0;	// of the non-blocking reconnect in progress
+		bool connect_retry = false;		// unix backlog was full, call connect again instead of polling
+		bool proving = false;			// reconnected, nothing received on the new link yet
+
+		struct Unacked
+		{
+			int session;
+			int64_t sent_at;
+			std::string frame;
+		};
+		std::vector<Unacked> unacked; // framed requests waiting for their response, oldest first
 		std::string send_buffer;
 		std::string recv_buffer;
 		Status status;
+		bool readable = true;
+		bool corked = false;
+		bool pinned = false;	// holds a reference on the network thread's cpu pin
 
 		int64_t client_timestamp; // ping when client send
 		int64_t server_timestamp; // ping when client recv from server
 		int64_t last_recv_timestamp;
+		int64_t last_send_timestamp = 0; // realtime connections only, keeps NetHost spinning after a send
+
+		struct ClockSample
+		{
+			int64_t rtt;	// us
+			double offset;	// s, server - client
+		};
+		static constexpr int CLOCK_WINDOW = 8;
+		std::deque<int64_t> ping_sent; // send time of pings not answered yet, replies come back in order
+		ClockSample clock_window[CLOCK_WINDOW];
+		int clock_count = 0;
 
 	private:
-		void SocketStart();
-		int  SocketSetNonblock();
-		int  SocketClose();
-		int  SocketConnect(const sockaddr_t * addr, int id, int64_t& now);
-		int	 SocketSelectConnect(int ms);
-
-		bool CheckMessageComplete(int id);
-		void DispatchMessage(int id, int64_t& now);
+		static void SocketStart();
+		void PinThread(int cpu);
+		void UnpinThread();
+		void SetCork(bool on);
+		int  SocketSetNonblock(SOCKET s);
+		void SocketSetOptions(SOCKET s);
+		int  SocketClose(SOCKET s);
+		bool ResolveInet();
+		bool ResolveUnix(const std::string& path);
+		SOCKET SocketOpen();
+		int  SocketConnect(int id, int64_t& now);
+		int	 SocketSelectConnect(SOCKET s, int ms);
+		void OnConnected(int id, int64_t& now);
+		int  SocketConnectStart(SOCKET s);
+		int  SocketPollConnect(SOCKET s);
+		void StartStandby();
+		bool StandbyAlive();
+		void Fail(int id, Status s);
+		bool Reconnecting() const { return options.reconnect > 0 && (status == Status::ConnectIng || reconnect_count < options.reconnect); }
+		void ReconnectFailed(int id);
+		void OnReconnected(int id, int64_t& now);
+		void AddUnacked(int session, const char* frame, size_t size);
+
+		void ParseOptions(const std::string& query);
+		const ClockSample& AddClockSample(const ClockSample& sample);
+		bool UnpackBody(const char* body, size_t size, kj::Array<capnp::word>& data);
+
+		bool CheckMessageComplete(int id, Status& failure);
+		void DispatchMessage(int id, int64_t& now, Status& failure);
+		bool DeliverMessages();
 	};
 }